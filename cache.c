@@ -0,0 +1,501 @@
+#include "cache.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <zlib.h>
+
+#include <libavutil/avstring.h>
+#include <libavutil/error.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/mem.h>
+
+#define FRAME_CACHE_MAGIC   0x45434346 /* "FCCE" */
+#define FRAME_CACHE_VERSION 1
+#define FRAME_CACHE_ALIGN   32
+
+#define HASH_SAMPLE_SIZE    (1 << 16)
+#define HASH_HEADER_SIZE    4096
+
+struct frame_cache_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t input_hash;
+
+    int32_t width, height;
+    int32_t pix_fmt;
+    int32_t reserved;
+
+    int64_t nb_frames; /* Zero until the cache is finished */
+};
+
+struct frame_record
+{
+    int64_t pts;
+    uint32_t size; /* Compressed size of the frame */
+    uint32_t reserved;
+};
+
+struct frame_cache
+{
+    struct frame_cache_header header;
+
+    FILE* file;         /* Cache being written */
+    char* path;         /* Final path of the cache */
+    char* tmp_path;     /* Path written to until the cache is finished */
+    uint8_t* map;       /* Cache being read */
+    size_t map_size;
+    size_t offset;
+    int64_t nb_frames;  /* Frames written or read so far */
+
+    uint8_t* image;     /* Uncompressed frame */
+    int image_size;
+    uint8_t* compressed;
+    uLong compressed_size;
+};
+
+static uint64_t fnv1a(uint64_t hash, const void* data, size_t size)
+{
+    const uint8_t* p = data;
+
+    for (size_t i = 0; i < size; i++) {
+        hash ^= p[i];
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+/*
+ * Hashes the size, modification time, head and tail of a file.
+ * Hashing the whole capture would cost as much I/O as decoding it.
+ */
+static int hash_file(const char* filename, uint64_t* hash)
+{
+    static uint8_t buf[HASH_SAMPLE_SIZE];
+    struct stat st;
+    int64_t size, mtime;
+    size_t n;
+    FILE* f;
+
+    if (stat(filename, &st) < 0 || !(f = fopen(filename, "rb")))
+        return AVERROR(errno);
+
+    size = st.st_size;
+    mtime = st.st_mtime;
+
+    *hash = fnv1a(0xcbf29ce484222325ULL, &size, sizeof(size));
+    *hash = fnv1a(*hash, &mtime, sizeof(mtime));
+
+    n = fread(buf, 1, sizeof(buf), f);
+    *hash = fnv1a(*hash, buf, n);
+
+    if (size > HASH_SAMPLE_SIZE && fseeko(f, -HASH_SAMPLE_SIZE, SEEK_END) == 0) {
+        n = fread(buf, 1, sizeof(buf), f);
+        *hash = fnv1a(*hash, buf, n);
+    }
+
+    fclose(f);
+    return 0;
+}
+
+/* Hashes the start of a file, which holds the container layout */
+static int hash_file_header(const char* filename, uint64_t* hash)
+{
+    uint8_t buf[HASH_HEADER_SIZE];
+    size_t n;
+    FILE* f;
+
+    if (!(f = fopen(filename, "rb")))
+        return AVERROR(errno);
+
+    n = fread(buf, 1, sizeof(buf), f);
+    *hash = fnv1a(0xcbf29ce484222325ULL, buf, n);
+
+    fclose(f);
+    return 0;
+}
+
+/* Maps an existing cache file into memory */
+static int map_cache_file(struct frame_cache* c, const char* filename)
+{
+    struct stat st;
+    void* map;
+    int fd;
+
+    if ((fd = open(filename, O_RDONLY)) < 0)
+        return AVERROR(errno);
+
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(struct frame_cache_header)) {
+        close(fd);
+        return AVERROR_INVALIDDATA;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED)
+        return AVERROR(errno);
+
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    c->map = map;
+    c->map_size = st.st_size;
+    c->offset = sizeof(struct frame_cache_header);
+
+    return 0;
+}
+
+int frame_cache_open(struct frame_cache** fc,
+                     const char* filename,
+                     const char* input_filename,
+                     int width,
+                     int height,
+                     enum AVPixelFormat pix_fmt)
+{
+    struct frame_cache* c;
+    struct frame_cache_header header;
+    mode_t mask;
+    int error, fd;
+
+    if (!(c = av_mallocz(sizeof(*c)))) {
+        fprintf(stderr, "Failed to allocate frame cache\n");
+        return AVERROR(ENOMEM);
+    }
+
+    c->header.magic = FRAME_CACHE_MAGIC;
+    c->header.version = FRAME_CACHE_VERSION;
+    c->header.width = width;
+    c->header.height = height;
+    c->header.pix_fmt = pix_fmt;
+
+    if ((error = hash_file(input_filename, &c->header.input_hash)) < 0) {
+        fprintf(stderr, "Failed to hash input file '%s'\n", input_filename);
+        goto fail;
+    }
+
+    if ((c->image_size = av_image_get_buffer_size(pix_fmt, width, height, FRAME_CACHE_ALIGN)) < 0) {
+        error = c->image_size;
+        fprintf(stderr, "Unsupported frame cache format: %s\n", av_err2str(error));
+        goto fail;
+    }
+
+    c->compressed_size = compressBound(c->image_size);
+
+    if (!(c->image = av_malloc(c->image_size)) ||
+        !(c->compressed = av_malloc(c->compressed_size))) {
+        fprintf(stderr, "Failed to allocate frame cache buffers\n");
+        error = AVERROR(ENOMEM);
+        goto fail;
+    }
+
+    /* Reuse the cache if it was finished for the same input and format */
+    if (map_cache_file(c, filename) == 0) {
+        memcpy(&header, c->map, sizeof(header));
+
+        if (header.nb_frames > 0) {
+            c->header.nb_frames = header.nb_frames;
+
+            if (!memcmp(&header, &c->header, sizeof(header))) {
+                *fc = c;
+                return 0;
+            }
+
+            c->header.nb_frames = 0;
+        }
+
+        munmap(c->map, c->map_size);
+        c->map = NULL;
+    }
+
+    /*
+     * Otherwise start a new cache in a temporary file, which is renamed
+     * into place once finished. Other runs sharing the cache then only
+     * ever see complete caches, and readers keep their mapping.
+     */
+    mask = umask(0);
+    umask(mask);
+
+    if (!(c->path = av_strdup(filename)) ||
+        !(c->tmp_path = av_asprintf("%s.XXXXXX", filename))) {
+        fprintf(stderr, "Failed to allocate frame cache path\n");
+        error = AVERROR(ENOMEM);
+        goto fail;
+    }
+
+    /* mkstemp creates the file as 0600, publish it with the usual permissions */
+    if ((fd = mkstemp(c->tmp_path)) < 0 ||
+        fchmod(fd, 0666 & ~mask) < 0 ||
+        !(c->file = fdopen(fd, "wb"))) {
+        error = AVERROR(errno);
+        fprintf(stderr, "Failed to create frame cache '%s'\n", c->tmp_path);
+        if (fd >= 0) {
+            close(fd);
+            unlink(c->tmp_path);
+        }
+        av_freep(&c->tmp_path);
+        goto fail;
+    }
+
+    if (fwrite(&c->header, sizeof(c->header), 1, c->file) != 1) {
+        error = AVERROR(EIO);
+        fprintf(stderr, "Failed to write frame cache header\n");
+        goto fail;
+    }
+
+    *fc = c;
+    return 0;
+
+fail:
+    frame_cache_close(&c);
+    return error;
+}
+
+int frame_cache_reading(struct frame_cache* fc)
+{
+    return fc->map != NULL;
+}
+
+int frame_cache_write(struct frame_cache* fc, const AVFrame* frame)
+{
+    struct frame_record record;
+    uLong size = fc->compressed_size;
+    int error;
+
+    if ((error = av_image_copy_to_buffer(fc->image,
+                                         fc->image_size,
+                                         (const uint8_t* const*)frame->data,
+                                         frame->linesize,
+                                         fc->header.pix_fmt,
+                                         fc->header.width,
+                                         fc->header.height,
+                                         FRAME_CACHE_ALIGN)) < 0) {
+        fprintf(stderr, "Failed to copy frame to cache: %s\n", av_err2str(error));
+        return error;
+    }
+
+    if (compress2(fc->compressed, &size, fc->image, fc->image_size, Z_BEST_SPEED) != Z_OK) {
+        fprintf(stderr, "Failed to compress cached frame\n");
+        return AVERROR_EXTERNAL;
+    }
+
+    memset(&record, 0, sizeof(record));
+    record.pts = frame->pts;
+    record.size = (uint32_t)size;
+
+    if (fwrite(&record, sizeof(record), 1, fc->file) != 1 ||
+        fwrite(fc->compressed, size, 1, fc->file) != 1) {
+        fprintf(stderr, "Failed to write frame to cache\n");
+        return AVERROR(EIO);
+    }
+
+    fc->nb_frames++;
+    return 0;
+}
+
+int frame_cache_read(struct frame_cache* fc, AVFrame* frame, int64_t max_pts)
+{
+    struct frame_record record;
+    uLongf size = fc->image_size;
+    int error;
+
+    if (fc->nb_frames >= fc->header.nb_frames)
+        return AVERROR_EOF;
+
+    if (fc->offset + sizeof(record) > fc->map_size)
+        return AVERROR_INVALIDDATA;
+
+    memcpy(&record, fc->map + fc->offset, sizeof(record));
+
+    if (record.pts != AV_NOPTS_VALUE && record.pts > max_pts)
+        return AVERROR(EAGAIN);
+
+    if (fc->offset + sizeof(record) + record.size > fc->map_size)
+        return AVERROR_INVALIDDATA;
+
+    /* Inflate straight from the mapped file */
+    if (uncompress(fc->image, &size, fc->map + fc->offset + sizeof(record), record.size) != Z_OK ||
+        size != (uLongf)fc->image_size) {
+        fprintf(stderr, "Corrupt frame in cache\n");
+        return AVERROR_INVALIDDATA;
+    }
+
+    if ((error = av_image_fill_arrays(frame->data,
+                                      frame->linesize,
+                                      fc->image,
+                                      fc->header.pix_fmt,
+                                      fc->header.width,
+                                      fc->header.height,
+                                      FRAME_CACHE_ALIGN)) < 0)
+        return error;
+
+    frame->width = fc->header.width;
+    frame->height = fc->header.height;
+    frame->format = fc->header.pix_fmt;
+    frame->pts = record.pts;
+
+    fc->offset += sizeof(record) + record.size;
+    fc->nb_frames++;
+
+    return 0;
+}
+
+int frame_cache_finish(struct frame_cache* fc)
+{
+    int error;
+
+    if (!fc->file)
+        return 0;
+
+    fc->header.nb_frames = fc->nb_frames;
+
+    if (fseeko(fc->file, 0, SEEK_SET) < 0 ||
+        fwrite(&fc->header, sizeof(fc->header), 1, fc->file) != 1 ||
+        fflush(fc->file) != 0) {
+        fprintf(stderr, "Failed to finish frame cache\n");
+        return AVERROR(EIO);
+    }
+
+    error = fclose(fc->file);
+    fc->file = NULL;
+
+    if (error != 0 || rename(fc->tmp_path, fc->path) < 0) {
+        fprintf(stderr, "Failed to finish frame cache '%s'\n", fc->path);
+        return AVERROR(EIO);
+    }
+
+    av_freep(&fc->tmp_path);
+    return 0;
+}
+
+void frame_cache_close(struct frame_cache** fc)
+{
+    struct frame_cache* c = *fc;
+
+    if (!c)
+        return;
+
+    if (c->file)
+        fclose(c->file);
+
+    /* An unfinished cache is discarded */
+    if (c->tmp_path)
+        unlink(c->tmp_path);
+
+    if (c->map)
+        munmap(c->map, c->map_size);
+
+    av_free(c->path);
+    av_free(c->tmp_path);
+    av_free(c->image);
+    av_free(c->compressed);
+    av_freep(fc);
+}
+
+int probe_cache_load(const char* filename, const char* input_filename, AVFormatContext* fmt_ctx)
+{
+    uint64_t hash, key, channel_layout;
+    unsigned int index, found = 0;
+    uint8_t* filled;
+    char line[256];
+    int type, id, format, width, height, sample_rate, channels;
+    AVRational avg_frame_rate, r_frame_rate;
+    int error;
+    FILE* f;
+
+    if ((error = hash_file_header(input_filename, &hash)) < 0)
+        return error;
+
+    if (!(f = fopen(filename, "r")))
+        return AVERROR(ENOENT);
+
+    /* The same key may have been stored more than once, count each stream once */
+    if (!(filled = av_mallocz(fmt_ctx->nb_streams))) {
+        fclose(f);
+        return AVERROR(ENOMEM);
+    }
+
+    /*
+     * One line per stream: key, index, then the parameters probing would find.
+     * Lines left truncated or interleaved by concurrent appends are skipped.
+     */
+    while (found < fmt_ctx->nb_streams && fgets(line, sizeof(line), f)) {
+        AVStream* stream;
+        AVCodecParameters* par;
+
+        if (sscanf(line, "%" SCNx64 " %u %d %d %d %d %d %d %d %" SCNu64 " %d/%d %d/%d",
+                   &key, &index, &type, &id, &format, &width, &height,
+                   &sample_rate, &channels, &channel_layout,
+                   &avg_frame_rate.num, &avg_frame_rate.den,
+                   &r_frame_rate.num, &r_frame_rate.den) != 14)
+            continue;
+
+        if (key != hash || index >= fmt_ctx->nb_streams || filled[index])
+            continue;
+
+        stream = fmt_ctx->streams[index];
+        par = stream->codecpar;
+
+        if ((int)par->codec_type != type || (int)par->codec_id != id)
+            continue;
+
+        par->format = format;
+        par->width = width;
+        par->height = height;
+        par->sample_rate = sample_rate;
+        par->channels = channels;
+        par->channel_layout = channel_layout;
+        stream->avg_frame_rate = avg_frame_rate;
+        stream->r_frame_rate = r_frame_rate;
+
+        filled[index] = 1;
+        found++;
+    }
+
+    av_free(filled);
+    fclose(f);
+    return found == fmt_ctx->nb_streams ? 0 : AVERROR(ENOENT);
+}
+
+int probe_cache_store(const char* filename, const char* input_filename, AVFormatContext* fmt_ctx)
+{
+    uint64_t hash;
+    int error;
+    FILE* f;
+
+    if ((error = hash_file_header(input_filename, &hash)) < 0)
+        return error;
+
+    if (!(f = fopen(filename, "a"))) {
+        error = AVERROR(errno);
+        fprintf(stderr, "Failed to open probe cache '%s'\n", filename);
+        return error;
+    }
+
+    for (unsigned int i = 0; i < fmt_ctx->nb_streams; i++) {
+        AVStream* stream = fmt_ctx->streams[i];
+        AVCodecParameters* par = stream->codecpar;
+
+        fprintf(f, "%016" PRIx64 " %u %d %d %d %d %d %d %d %" PRIu64 " %d/%d %d/%d\n",
+                hash, i, par->codec_type, par->codec_id, par->format,
+                par->width, par->height, par->sample_rate, par->channels,
+                par->channel_layout,
+                stream->avg_frame_rate.num, stream->avg_frame_rate.den,
+                stream->r_frame_rate.num, stream->r_frame_rate.den);
+    }
+
+    if (fclose(f) != 0) {
+        fprintf(stderr, "Failed to write probe cache '%s'\n", filename);
+        return AVERROR(EIO);
+    }
+
+    return 0;
+}
@@ -0,0 +1,54 @@
+#ifndef cache_h
+#define cache_h
+
+#include <stdint.h>
+
+#include <libavformat/avformat.h>
+#include <libavutil/frame.h>
+#include <libavutil/pixfmt.h>
+
+struct frame_cache;
+
+/*
+ * Opens a frame cache for the given input file.
+ * If the cache file holds a complete set of frames decoded from
+ * the same input it is mapped for reading, otherwise it is
+ * (re)created and filled as frames are decoded.
+ */
+int frame_cache_open(struct frame_cache** fc,
+                     const char* filename,
+                     const char* input_filename,
+                     int width,
+                     int height,
+                     enum AVPixelFormat pix_fmt);
+
+/* Returns nonzero if frames are read from the cache */
+int frame_cache_reading(struct frame_cache* fc);
+
+/* Appends a decoded frame to the cache */
+int frame_cache_write(struct frame_cache* fc, const AVFrame* frame);
+
+/*
+ * Reads the next cached frame unless its timestamp is past max_pts.
+ * Returns AVERROR(EAGAIN) if it is, AVERROR_EOF once all frames are read.
+ * The frame data points into the cache and is valid until the next read.
+ */
+int frame_cache_read(struct frame_cache* fc, AVFrame* frame, int64_t max_pts);
+
+/* Marks a written cache as complete, so later runs may read it */
+int frame_cache_finish(struct frame_cache* fc);
+
+/* Closes the cache */
+void frame_cache_close(struct frame_cache** fc);
+
+/*
+ * Fills in the stream parameters cached for an input with the same
+ * file header, so that probing the streams can be skipped.
+ * Returns AVERROR(ENOENT) if not all streams were found in the cache.
+ */
+int probe_cache_load(const char* filename, const char* input_filename, AVFormatContext* fmt_ctx);
+
+/* Appends the stream parameters of a probed input to the cache */
+int probe_cache_store(const char* filename, const char* input_filename, AVFormatContext* fmt_ctx);
+
+#endif /* cache_h */
@@ -1,5 +1,7 @@
 #include "encoder.h"
+#include "cache.h"
 
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -7,12 +9,15 @@
 #include <libavformat/avformat.h>
 #include <libavutil/imgutils.h>
 #include <libavutil/opt.h>
+#include <libavutil/time.h>
 #include <libswscale/swscale.h>
 
 static int out_width, out_height;
 static double crf;
 static int64_t bitrate;
 static const char* x264_preset;
+static int preview_step;
+static const char* probe_cache_filename;
 
 static AVFormatContext* i_vfmt_ctx; /* Input video format context */
 static AVFormatContext* i_afmt_ctx; /* Input audio format context */
@@ -26,6 +31,36 @@ static AVCodecContext* o_acodec_ctx; /* Audio encoder context */
 static struct SwsContext* sws_ctx;
 static AVFrame* scaled_frame;
 
+static struct frame_cache* frame_cache;
+static int64_t video_frame_number; /* Video frames encoded so far */
+static int64_t input_frame_number; /* Input video frames passed so far */
+
+/*
+ * Returns nonzero if the container header alone
+ * describes every stream, as sox headers always do
+ */
+static int stream_params_complete(AVFormatContext* ifmt_ctx)
+{
+    for (unsigned int i = 0; i < ifmt_ctx->nb_streams; i++) {
+        AVStream* stream = ifmt_ctx->streams[i];
+        AVCodecParameters* par = stream->codecpar;
+        
+        if (par->codec_id == AV_CODEC_ID_NONE)
+            return 0;
+        
+        if (par->codec_type == AVMEDIA_TYPE_VIDEO &&
+            (par->width <= 0 || par->height <= 0 || par->format < 0 ||
+             (stream->avg_frame_rate.num <= 0 && stream->r_frame_rate.num <= 0)))
+            return 0;
+        
+        if (par->codec_type == AVMEDIA_TYPE_AUDIO &&
+            (par->sample_rate <= 0 || par->channels <= 0))
+            return 0;
+    }
+    
+    return 1;
+}
+
 /*
  * Opens the input video or 
  * audio file and corresponding decoder
@@ -33,18 +68,58 @@ static AVFrame* scaled_frame;
 static int open_input_file(const char* filename, int is_audio)
 {
     AVFormatContext* ifmt_ctx = NULL;
+    AVInputFormat* ifmt = NULL;
+    AVDictionary* options = NULL;
     int error;
     
+    /* Fast open: skip format probing and limit stream probing */
+    if (probe_cache_filename) {
+        ifmt = av_find_input_format(is_audio ? "sox" : "avi");
+        av_dict_set(&options, "probesize", "1048576", 0);
+        av_dict_set(&options, "analyzeduration", "500000", 0);
+    }
+    
     /* Open input file */
-    if ((error = avformat_open_input(&ifmt_ctx, filename, NULL, NULL)) < 0) {
+    error = avformat_open_input(&ifmt_ctx, filename, ifmt, &options);
+    av_dict_free(&options);
+    
+    if (error < 0) {
         fprintf(stderr, "Failed to open input file\n");
         return error;
     }
     
-    /* Find stream information */
-    if ((error = avformat_find_stream_info(ifmt_ctx, NULL)) < 0) {
-        fprintf(stderr, "Could not find stream information\n");
-        return error;
+    /* Find stream information, unless the header or probe cache has it */
+    if (!probe_cache_filename ||
+        (!stream_params_complete(ifmt_ctx) &&
+         (probe_cache_load(probe_cache_filename, filename, ifmt_ctx) < 0 ||
+          !stream_params_complete(ifmt_ctx)))) {
+        
+        if ((error = avformat_find_stream_info(ifmt_ctx, NULL)) < 0) {
+            fprintf(stderr, "Could not find stream information\n");
+            return error;
+        }
+        
+        /*
+         * The fast probe fell short. Stream information can only be found
+         * once per context, so reopen the input with the default limits.
+         */
+        if (probe_cache_filename && !stream_params_complete(ifmt_ctx)) {
+            avformat_close_input(&ifmt_ctx);
+            
+            if ((error = avformat_open_input(&ifmt_ctx, filename, ifmt, NULL)) < 0) {
+                fprintf(stderr, "Failed to open input file\n");
+                return error;
+            }
+            
+            if ((error = avformat_find_stream_info(ifmt_ctx, NULL)) < 0) {
+                fprintf(stderr, "Could not find stream information\n");
+                return error;
+            }
+        }
+        
+        /* Never cache parameters that later runs could not use */
+        if (probe_cache_filename && stream_params_complete(ifmt_ctx))
+            probe_cache_store(probe_cache_filename, filename, ifmt_ctx);
     }
     
     /* Find and open decoders */
@@ -73,6 +148,15 @@ static int open_input_file(const char* filename, int is_audio)
             if (codec_ctx->codec_type == AVMEDIA_TYPE_VIDEO) {
                 
                 codec_ctx->framerate = av_guess_frame_rate(ifmt_ctx, stream, NULL);
+                
+                /* Only keyframes are decoded in preview mode */
+                if (preview_step) {
+                    stream->discard = AVDISCARD_NONKEY;
+                    codec_ctx->skip_frame = AVDISCARD_NONKEY;
+                    codec_ctx->skip_loop_filter = AVDISCARD_ALL;
+                    codec_ctx->flags2 |= AV_CODEC_FLAG2_FAST;
+                }
+                
                 /* assign input video codec context */
                 i_vcodec_ctx = codec_ctx;
             } else if (codec_ctx->codec_type == AVMEDIA_TYPE_AUDIO) {
@@ -91,7 +175,9 @@ static int open_input_file(const char* filename, int is_audio)
     
     is_audio ? (i_afmt_ctx = ifmt_ctx) : (i_vfmt_ctx = ifmt_ctx);
     
-    av_dump_format(ifmt_ctx, is_audio, filename, 0);
+    if (!probe_cache_filename)
+        av_dump_format(ifmt_ctx, is_audio, filename, 0);
+    
     return 0;
 }
 
@@ -158,6 +244,9 @@ static int open_output_file(const char* filename)
     
     av_opt_set(o_vcodec_ctx->priv_data, "preset", x264_preset, 0);
     
+    if (preview_step)
+        av_opt_set(o_vcodec_ctx->priv_data, "tune", "zerolatency", 0);
+    
     char buf[8];
     memset(buf, 0, 8 * sizeof(char));
     sprintf(buf, "%.2lf", crf);
@@ -292,7 +381,7 @@ static int encode_write_frame(AVFrame* frame, AVFormatContext* o_fmt_ctx, AVCode
             fflush(stdout);
             
             if (stream_index == 0)
-            printf("Progess: %.2lf%%\r", (double)i_vcodec_ctx->frame_number / 
+            printf("Progess: %.2lf%%\r", (double)input_frame_number / 
                    (double)i_vfmt_ctx->streams[0]->nb_frames * 100);
             
             error = av_interleaved_write_frame(o_fmt_ctx, &pkt);
@@ -331,9 +420,54 @@ static int scale_video_frame(AVFrame* in, AVFrame* out)
     return 0;
 }
 
+/* Scales and encodes a decoded or cached video frame */
+static int write_video_frame(AVFrame* frame)
+{
+    int error;
+    
+    /* Scale the frame to set output resolution */
+    if ((error = scale_video_frame(frame, scaled_frame)) < 0)
+        return error;
+    
+    scaled_frame->pts = frame->pts;
+    video_frame_number++;
+    
+    /* Preview mode skips frames, so track progress by timestamp */
+    if (preview_step && frame->pts != AV_NOPTS_VALUE)
+        input_frame_number = av_rescale_q(frame->pts,
+                                          i_vfmt_ctx->streams[0]->time_base,
+                                          av_inv_q(i_vcodec_ctx->framerate)) + 1;
+    else
+        input_frame_number = video_frame_number;
+    
+    /* Write video frame */
+    return encode_write_frame(scaled_frame, o_fmt_ctx, o_vcodec_ctx, 0);
+}
+
+/* Encodes cached frames up to the given timestamp */
+static int write_cached_frames(AVFrame* frame, int64_t max_pts)
+{
+    int error;
+    
+    while ((error = frame_cache_read(frame_cache, frame, max_pts)) >= 0) {
+        if ((error = write_video_frame(frame)) < 0)
+            return error;
+    }
+    
+    if (error == AVERROR(EAGAIN) || error == AVERROR_EOF)
+        return 0;
+    
+    fprintf(stderr, "Error while reading frame cache\n");
+    return error;
+}
+
 int encoder_init(struct encoder* e)
 {
+    int64_t start = av_gettime_relative();
+    
     e->closed = 0;
+    preview_step = e->preview;
+    probe_cache_filename = e->probe_cache_filename;
     
     /* Open input files */
     if (open_input_file(e->i_video_filename, 0) < 0)
@@ -343,7 +477,8 @@ int encoder_init(struct encoder* e)
         if (open_input_file(e->i_audio_filename, 1) < 0)
             fprintf(stderr, "Audio file not supplied. Using video audio stream.\n");
             
-    if ((e->sx == 0 || e->sy == 0) &&
+    if (!preview_step &&
+        (e->sx == 0 || e->sy == 0) &&
         (e->ow == 0 || e->oh == 0))
     {
         fprintf(stderr, "Resolution cannot be zero\n");
@@ -362,6 +497,22 @@ int encoder_init(struct encoder* e)
         out_height = i_vcodec_ctx->height * e->sy;
     }
     
+    /* Preview at half the input resolution with the fastest preset */
+    if (preview_step)
+    {
+        if ((e->ow != 0 && e->oh != 0) || (e->sx != 0 && e->sy != 0))
+            fprintf(stderr, "Warning: scale is ignored in preview mode\n");
+        
+        out_width = FFMAX(i_vcodec_ctx->width / 2 & ~1, 2);
+        out_height = FFMAX(i_vcodec_ctx->height / 2 & ~1, 2);
+        x264_preset = "ultrafast";
+    }
+    
+    /* Report the effective output settings back */
+    e->ow = out_width;
+    e->oh = out_height;
+    e->x264_preset = x264_preset;
+    
     /* Open output */
     if (open_output_file(e->o_filename) < 0)
         return -1;
@@ -384,11 +535,33 @@ int encoder_init(struct encoder* e)
                              out_width,
                              out_height,
                              AV_PIX_FMT_YUV420P,
-                             SWS_POINT,
+                             preview_step ? SWS_FAST_BILINEAR : SWS_POINT,
                              0, 0, 0);
     if (!sws_ctx)
         return -1;
     
+    /* Open frame cache, preview mode would only fill it partially */
+    if (e->cache_filename && preview_step) {
+        fprintf(stderr, "Frame cache is not used in preview mode\n");
+    } else if (e->cache_filename) {
+        if (frame_cache_open(&frame_cache,
+                             e->cache_filename,
+                             e->i_video_filename,
+                             i_vcodec_ctx->width,
+                             i_vcodec_ctx->height,
+                             i_vcodec_ctx->pix_fmt) < 0) {
+            /* The cache is only an optimization, encode without it */
+            fprintf(stderr, "Warning: failed to open frame cache '%s', encoding without it\n",
+                    e->cache_filename);
+        } else {
+            printf("%s frame cache '%s'\n",
+                   frame_cache_reading(frame_cache) ? "Reading from" : "Writing to",
+                   e->cache_filename);
+        }
+    }
+    
+    e->startup_time = (av_gettime_relative() - start) / 1000000.0;
+    
     return 0;
 }
 
@@ -396,6 +569,8 @@ int encoder_encode(struct encoder* e)
 {
     int error;
     int audio_eof = 0;
+    int64_t preview_packet_number = 0;
+    int64_t start = av_gettime_relative();
     AVPacket pkt;
     AVFrame* frame;
     
@@ -407,7 +582,22 @@ int encoder_encode(struct encoder* e)
         if ((error = av_read_frame(i_vfmt_ctx, &pkt)))
             break;
         
-        if (pkt.stream_index == 0) {
+        /* Only decode every Nth keyframe in preview mode */
+        if (pkt.stream_index == 0 && preview_step) {
+            if (!(pkt.flags & AV_PKT_FLAG_KEY) || preview_packet_number++ % preview_step) {
+                av_packet_unref(&pkt);
+                continue;
+            }
+        }
+        
+        if (pkt.stream_index == 0 && frame_cache && frame_cache_reading(frame_cache)) {
+            
+            /* Skip decoding, encode the cached frames up to this packet */
+            if ((error = write_cached_frames(frame, pkt.pts != AV_NOPTS_VALUE ? pkt.pts : pkt.dts)) < 0)
+                goto end;
+            
+            av_frame_unref(frame);
+        } else if (pkt.stream_index == 0) {
             if ((error = avcodec_send_packet(i_vcodec_ctx, &pkt)) < 0) {
                 fprintf(stderr, "Error while sending packet to decoder\n");
                 break;
@@ -424,12 +614,13 @@ int encoder_encode(struct encoder* e)
                 
                 frame->pts = frame->best_effort_timestamp;
                 
-                /* Scale the frame to set output resolution */
-                scale_video_frame(frame, scaled_frame);
-                scaled_frame->pts = frame->pts;
+                /* The cache is only an optimization, keep encoding without it */
+                if (frame_cache && frame_cache_write(frame_cache, frame) < 0) {
+                    fprintf(stderr, "Warning: dropping frame cache\n");
+                    frame_cache_close(&frame_cache);
+                }
                 
-                /* Write video frame */
-                error = encode_write_frame(scaled_frame, o_fmt_ctx, o_vcodec_ctx, 0);
+                error = write_video_frame(frame);
             }
             
             av_frame_unref(frame);
@@ -468,21 +659,36 @@ int encoder_encode(struct encoder* e)
         av_packet_unref(&pkt);
     }
     
+    /* Only a cache of the whole input is finished, anything else is dropped */
+    if (frame_cache) {
+        if (frame_cache_reading(frame_cache)) {
+            if (write_cached_frames(frame, INT64_MAX) < 0)
+                goto end;
+        } else if (error != AVERROR_EOF || frame_cache_finish(frame_cache) < 0) {
+            fprintf(stderr, "Warning: frame cache left unfinished\n");
+        }
+    }
+    
     av_write_trailer(o_fmt_ctx);
     
     e->closed = 1;
     
 end:
-    printf("Successfully encoded %d out of %lld frames\n",
-           i_vcodec_ctx->frame_number,
+    printf("Successfully encoded %" PRId64 " out of %lld frames\n",
+           video_frame_number,
            i_vfmt_ctx->streams[0]->nb_frames);
     
+    printf("Startup took %.3lfs, encoding took %.3lfs\n",
+           e->startup_time,
+           (av_gettime_relative() - start) / 1000000.0);
+    
     return 0;
 }
 
 void encoder_close(struct encoder* e)
 {
     av_frame_free(&scaled_frame);
+    frame_cache_close(&frame_cache);
     
     avformat_free_context(i_vfmt_ctx);
     avformat_free_context(i_afmt_ctx);
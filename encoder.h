@@ -10,6 +10,8 @@ struct encoder
     const char* i_video_filename; /* Input video */
     const char* i_audio_filename; /* Input audio, if any */
     const char* o_filename; /* Name of output file */
+    const char* cache_filename; /* Frame cache, if any */
+    const char* probe_cache_filename; /* Cached stream parameters, if any */
     
     int ow, oh;
     double sx, sy;
@@ -17,6 +19,10 @@ struct encoder
     
     const char* x264_preset;
     int64_t bitrate;
+    
+    int preview; /* Encode every Nth keyframe at half size, 0 if disabled */
+    
+    double startup_time; /* Seconds spent in encoder_init */
 };
 
 /*
@@ -18,6 +18,9 @@ static struct option long_options[] =
     {"crf",         required_argument,  0,  'c'},
     {"bitrate",     required_argument,  0,  'b'},
     {"x264-preset", required_argument,  0,  'p'},
+    {"cache",       required_argument,  0,  'f'},
+    {"preview",     required_argument,  0,  'd'},
+    {"probe-cache", required_argument,  0,  'r'},
     {"help",        no_argument,        0,  'h'},
     {0, 0, 0, 0},
 };
@@ -31,12 +34,16 @@ static const char* extension(const char *filename)
 
 static void usage()
 {
-    printf("usage: encode [-i input] [-scbp] [-o output]       \n");
+    printf("usage: encode [-i input] [-scbpfdr] [-o output]    \n");
     printf("  -i        file input: avi, sox                   \n");
     printf("  -s        set output video scale                 \n");
     printf("  -c        set constant rate factor (1.0 ... inf) \n");
     printf("  -b        set output bitrate                     \n");
     printf("  -p        x264 preset                            \n");
+    printf("  -f        frame cache, reused by later encodes   \n");
+    printf("  -d        draft preview of every Nth keyframe    \n");
+    printf("            (half size, ignores -s and -p)         \n");
+    printf("  -r        fast open using cached stream probes   \n");
     printf("  -o        file output: mkv                       \n");
 }
 
@@ -45,6 +52,8 @@ int main(int argc, char** argv)
     int c;
     struct encoder e;
     
+    memset(&e, 0, sizeof(e));
+    
     if (argc < 2)
     {
         usage();
@@ -55,7 +64,7 @@ int main(int argc, char** argv)
     {
         int option_index;
         
-        c = getopt_long(argc, argv, "i:o:ps:c:b:h", long_options, &option_index);
+        c = getopt_long(argc, argv, "i:o:ps:c:b:f:d:r:h", long_options, &option_index);
         if (c == -1)
             break;
         
@@ -93,6 +102,20 @@ int main(int argc, char** argv)
                 e.x264_preset = optarg;
                 break;
                 
+            case 'f':
+                e.cache_filename = optarg;
+                break;
+                
+            case 'd':
+                e.preview = atoi(optarg);
+                if (e.preview < 1)
+                    e.preview = 1;
+                break;
+                
+            case 'r':
+                e.probe_cache_filename = optarg;
+                break;
+                
             case 's':
                 if (!optarg)
                 {
@@ -165,6 +188,9 @@ int main(int argc, char** argv)
     printf("bitrate = %lld\n", e.bitrate);
     printf("x264 preset = %s\n", e.x264_preset);
     
+    if (e.preview)
+        printf("preview = every %d keyframe(s)\n", e.preview);
+    
     printf("\n\n");
     
     /* Start encoder */